@@ -5,9 +5,13 @@
 #include <memory>
 #include <type_traits>
 #include <limits>
+#include <atomic>
+#include <cassert>
 
 namespace bounded_queue {
 
+constexpr size_t cache_line = 64;
+
 template <class T> class Sep {
   private:
     static_assert(std::is_integral<T>::value, "not an integral");
@@ -51,6 +55,8 @@ class Memory {
     size_t size() const { return size_; }
 };
 
+template <class> class LocalConsumer;
+
 template <class Separator> class Element {
   private:
     Separator* sep_;
@@ -79,53 +85,79 @@ template <class Separator> class Element {
 
     template <class> friend class Producer;
     template <class> friend class Consumer;
+    template <class> friend class LocalConsumer;
 };
 
-template <class Separator> class Producer {
+/* Index bookkeeping of a Producer without any local memory, e.g. to
+ * assemble elements directly in a remote ring of the given size. */
+template <class Separator> class ProducerIndex {
   private:
-    std::shared_ptr<Memory> mem_;
+    size_t size_;
     Index front_;
     size_t left(Index back) const {
         if (front_ < back) {
             return back - front_;
         }
-        return mem_->size() - (front_ - back);
+        return size_ - (front_ - back);
     }
 
   public:
-    Producer(std::shared_ptr<Memory> mem) : mem_{mem}, front_{0} {}
+    ProducerIndex(size_t size) : size_{size}, front_{0} {}
 
-    Element<Separator> produce(size_t size, Index back) {
+    /* reserves an element of size, the header goes to idx and the footer to
+     * the new front() */
+    bool reserve(size_t size, Index back, Index& idx) {
         const size_t hdr_data_size = sizeof(Separator) + size;
         const size_t element_size = hdr_data_size + sizeof(Separator);
         if (element_size > left(back)) {
+            return false;
+        }
+        idx = front_;
+        front_ += hdr_data_size;
+        return true;
+    }
+
+    Index front() const { return front_; }
+};
+
+template <class Separator> class Producer {
+  private:
+    std::shared_ptr<Memory> mem_;
+    ProducerIndex<Separator> index_;
+
+  public:
+    Producer(std::shared_ptr<Memory> mem) : mem_{mem}, index_{mem->size()} {}
+
+    Element<Separator> produce(size_t size, Index back) {
+        Index idx;
+        if (!index_.reserve(size, back, idx)) {
             return {nullptr, 0};
         }
-        /*      front_
+        /*        idx
          *         |
          * ------------------------
          *   |H|+++|F|
          * ------------------------
          */
-        auto hdr = reinterpret_cast<Separator*>(mem_->at(front_));
+        auto hdr = reinterpret_cast<Separator*>(mem_->at(idx));
         hdr->header(size);
-        /*      front_
+        /*        idx
          *         |
          * ------------------------
          *   |H|+++|H|
          * ------------------------
          */
-        auto old_front = front_;
-        front_ += hdr_data_size;
-        reinterpret_cast<Separator*>(mem_->at(front_))->footer();
-        /*              front_
-         *                |
+        reinterpret_cast<Separator*>(mem_->at(index_.front()))->footer();
+        /*                front
+         *                  |
          * ------------------------
          *   |H|+++|H|++++|F|
          * ------------------------
          */
-        return {hdr, old_front};
+        return {hdr, idx};
     }
+
+    Index front() const { return index_.front(); }
 };
 
 template <class Separator> class Consumer {
@@ -179,6 +211,79 @@ template <class Separator> class Consumer {
 
     Index back() const { return back_; }
 };
+
+/* Indices shared by a LocalProducer/LocalConsumer pair, each on its own
+ * cache line. */
+struct LocalIndices {
+    char pad0_[cache_line];
+    /* written by the producer */
+    std::atomic<Index> front{0};
+    char pad1_[cache_line - sizeof(std::atomic<Index>)];
+    /* written by the consumer */
+    std::atomic<Index> back{0};
+    char pad2_[cache_line - sizeof(std::atomic<Index>)];
+};
+
+/* Producer for a consumer thread in the same process. Keeps a cached copy of
+ * the consumer's back and only reloads the shared one when the ring looks
+ * full. Elements become visible to the consumer on publish(). */
+template <class Separator> class LocalProducer {
+  private:
+    Producer<Separator> prod_;
+    std::shared_ptr<LocalIndices> idx_;
+    Index cached_back_;
+
+  public:
+    LocalProducer(std::shared_ptr<Memory> mem,
+                  std::shared_ptr<LocalIndices> idx)
+        : prod_{mem}, idx_{idx}, cached_back_{0} {}
+
+    Element<Separator> produce(size_t size) {
+        auto e = prod_.produce(size, cached_back_);
+        if (!e) {
+            cached_back_ = idx_->back.load(std::memory_order_acquire);
+            return prod_.produce(size, cached_back_);
+        }
+        return e;
+    }
+
+    /* make all produced (and filled in) elements visible */
+    void publish() {
+        idx_->front.store(prod_.front(), std::memory_order_release);
+    }
+};
+
+/* Consumer counterpart of LocalProducer. Keeps a cached copy of the
+ * producer's front and only reloads the shared one when the ring looks
+ * empty. Consumed space is handed back to the producer on release(). */
+template <class Separator> class LocalConsumer {
+  private:
+    Consumer<Separator> cons_;
+    std::shared_ptr<LocalIndices> idx_;
+    Index cached_front_;
+
+  public:
+    LocalConsumer(std::shared_ptr<Memory> mem,
+                  std::shared_ptr<LocalIndices> idx)
+        : cons_{mem}, idx_{idx}, cached_front_{0} {}
+
+    const Element<Separator> consume() {
+        if (cons_.back() == cached_front_) {
+            cached_front_ = idx_->front.load(std::memory_order_acquire);
+            if (cons_.back() == cached_front_) {
+                return {nullptr, 0};
+            }
+        }
+        return cons_.consume();
+    }
+
+    /* hand all consumed elements back to the producer */
+    void release() {
+        idx_->back.store(cons_.back(), std::memory_order_release);
+    }
+
+    Index back() const { return cons_.back(); }
+};
 }
 
 #endif /* BOUNDED_QUEUE_H */
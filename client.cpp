@@ -7,6 +7,12 @@
 #include <iomanip>
 #include <chrono>
 #include <cstring>
+#include <memory>
+#include <random>
+#include <deque>
+
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/mman.h>
 
@@ -23,8 +29,11 @@
 
 #include <bounded_queue.h>
 #include <common.h>
+#include <trace.h>
 
-using Producer = bounded_queue::Producer<bounded_queue::Sep<uint32_t>>;
+using Separator = bounded_queue::Sep<uint32_t>;
+using Producer = bounded_queue::Producer<Separator>;
+using ProducerIndex = bounded_queue::ProducerIndex<Separator>;
 
 constexpr size_t sample_size = 1e6;
 
@@ -46,6 +55,601 @@ inline std::ostream& operator<<(std::ostream& out, const Type& t) {
     return out;
 }
 
+/* send schedule of the open-loop mode */
+enum class Arrival { FIXED, POISSON };
+
+inline std::istream& operator>>(std::istream& in, Arrival& a) {
+    std::string str;
+    in >> str;
+    if (boost::iequals("fixed", str)) {
+        a = Arrival::FIXED;
+    } else if (boost::iequals("poisson", str)) {
+        a = Arrival::POISSON;
+    } else {
+        in.setstate(std::ios_base::failbit);
+    }
+    return in;
+}
+
+inline std::ostream& operator<<(std::ostream& out, const Arrival& a) {
+    out << (a == Arrival::FIXED ? "fixed" : "poisson");
+    return out;
+}
+
+inline uint64_t now_ns() {
+    using namespace std::chrono;
+    auto now = high_resolution_clock::now();
+    return duration_cast<nanoseconds>(now.time_since_epoch()).count();
+}
+
+struct Options {
+    psl::net::in_addr ip;
+    psl::net::in_port_t port;
+    size_t tx_depth;
+    size_t cq_mod;
+    size_t inline_data;
+    Bytes size;
+    bool hugepages;
+    Type type;
+    /* write timestamp_ns() into the first payload bytes */
+    bool stamp;
+    /* offered load in ops/sec per connection, 0 = closed loop */
+    double rate;
+    Arrival arrival;
+    /* gather elements from application buffers instead of a ring mirror */
+    bool direct;
+    /* QPs per connection and bytes per stripe */
+    size_t rails;
+    size_t stripe;
+    /* local addresses to bind rails to, round robin */
+    std::vector<psl::net::in_addr> srcs;
+};
+
+/* One QP to the server together with its CQ and either a local ring mirror
+ * or, with --direct, a scratch header/footer and per WR payload buffers.
+ * With --rails the mirror is written in stripes over several QPs. */
+struct Connection {
+    rdma_cm_id* id;
+    ibv_cq* cq;
+    /* written remotely by the server's consumer */
+    volatile uint64_t back;
+    ibv_mr* back_mr;
+    ServerConnectionData server_conn_data;
+    std::shared_ptr<bounded_queue::Memory> mem;
+    ibv_mr* mr;
+    std::unique_ptr<Producer> prod;
+
+    std::unique_ptr<ProducerIndex> index;
+    /* header and footer of every element, the size is fixed */
+    Separator seps[2];
+    ibv_mr* seps_mr;
+    /* one payload buffer per WR that can be in flight */
+    std::vector<char> buffers;
+    ibv_mr* buffers_mr;
+
+    ibv_send_wr wr;
+    /* mirror: whole element, direct: header, payload, footer */
+    ibv_sge sge[3];
+    size_t in_flight;
+    size_t posted;
+    std::vector<uint64_t> in_flight_times;
+    std::vector<uint64_t>::iterator times_iter;
+    /* intended send time of the next element in ns since the start of the
+     * run (open loop), kept fractional so intervals do not truncate */
+    double next_send;
+    /* trace: when the ring was found full, 0 = not waiting on back */
+    uint64_t full_since;
+
+    /* one QP of a striped connection, rail 0 aliases id/cq/mr above */
+    struct Rail {
+        rdma_cm_id* id;
+        ibv_cq* cq;
+        /* server ring and local mirror as seen through this rail's device */
+        uint32_t rkey;
+        ibv_mr* mr;
+        size_t in_flight;
+    };
+
+    /* a posted stripe of the mirror that is not published yet */
+    struct Stripe {
+        bounded_queue::Index start;
+        bounded_queue::Index end;
+        size_t elements;
+        bool landed;
+    };
+
+    std::vector<Rail> rails;
+    size_t next_rail;
+    /* posted stripes in ring order, the first one has sequence stripe_seq */
+    std::deque<Stripe> stripes;
+    uint64_t stripe_seq;
+    /* stripe being filled */
+    bounded_queue::Index stripe_start;
+    size_t stripe_elements;
+    size_t publishing;
+
+    explicit Connection(const Options& opt);
+
+  private:
+    rdma_cm_id* connect(const Options& opt, size_t rail, uint64_t session,
+                        size_t ncqe, size_t max_send_wr, ibv_cq*& rail_cq,
+                        ServerConnectionData& rail_data);
+};
+
+/* creates, connects and returns one QP (rail) to the server */
+rdma_cm_id* Connection::connect(const Options& opt, size_t rail,
+                                uint64_t session, size_t ncqe,
+                                size_t max_send_wr, ibv_cq*& rail_cq,
+                                ServerConnectionData& rail_data) {
+    rdma_cm_id* rail_id;
+    LOG_ERR_EXIT(rdma_create_id(nullptr, &rail_id, nullptr, RDMA_PS_TCP),
+                 errno, std::system_category());
+
+    sockaddr_in addr;
+    addr.sin_addr = opt.ip;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+
+    sockaddr_in src_addr = {};
+    sockaddr* src = nullptr;
+    if (!opt.srcs.empty()) {
+        /* pick the local device/port for this rail */
+        src_addr.sin_addr = opt.srcs[rail % opt.srcs.size()];
+        src_addr.sin_family = AF_INET;
+        src = reinterpret_cast<sockaddr*>(&src_addr);
+    }
+
+    LOG_ERR_EXIT(rdma_resolve_addr(rail_id, src,
+                                   reinterpret_cast<sockaddr*>(&addr), 1000),
+                 errno, std::system_category());
+
+    LOG_ERR_EXIT(rdma_resolve_route(rail_id, 1000), errno,
+                 std::system_category());
+
+    LOG_ERR_EXIT(
+        !(rail_cq = ibv_create_cq(rail_id->verbs, ncqe, NULL, NULL, 0)),
+        errno, std::system_category());
+
+    ibv_qp_init_attr qp_init_attr = {};
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.sq_sig_all = 0;
+    qp_init_attr.send_cq = rail_cq;
+    qp_init_attr.recv_cq = rail_cq;
+    qp_init_attr.cap.max_inline_data = opt.inline_data;
+    qp_init_attr.cap.max_recv_wr = 1;
+    qp_init_attr.cap.max_send_wr = max_send_wr;
+    qp_init_attr.cap.max_recv_sge = 1;
+    qp_init_attr.cap.max_send_sge = opt.direct ? 3 : 1;
+    LOG_ERR_EXIT(rdma_create_qp(rail_id, rail_id->pd, &qp_init_attr), errno,
+                 std::system_category());
+
+    ibv_device_attr dev_attr;
+    LOG_ERR_EXIT(ibv_query_device(rail_id->verbs, &dev_attr), errno,
+                 std::system_category());
+
+    ClientConnectionData conn_data = {};
+    conn_data.rail = rail;
+    conn_data.session = session;
+    if (rail == 0) {
+        /* the server's consumer reports back through rail 0 only */
+        LOG_ERR_EXIT(
+            !(back_mr = ibv_reg_mr(
+                  rail_id->pd, (void*)(&back), sizeof(back),
+                  IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                      IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC)),
+            errno, std::system_category());
+        conn_data.address = reinterpret_cast<uint64_t>(&back);
+        conn_data.rkey = back_mr->rkey;
+    }
+    rdma_conn_param conn_param = {};
+    conn_param.private_data = reinterpret_cast<void*>(&conn_data);
+    conn_param.private_data_len = sizeof(conn_data);
+    conn_param.responder_resources = dev_attr.max_qp_rd_atom;
+    conn_param.initiator_depth = dev_attr.max_qp_rd_atom;
+    LOG_ERR_EXIT(rdma_connect(rail_id, &conn_param), errno,
+                 std::system_category());
+
+    LOG_ERR_EXIT(rail_id->event->param.conn.private_data_len <
+                     sizeof(ServerConnectionData),
+                 EINVAL, std::system_category());
+    rail_data = *reinterpret_cast<const ServerConnectionData*>(
+        rail_id->event->param.conn.private_data);
+    return rail_id;
+}
+
+Connection::Connection(const Options& opt)
+    : back{0}, in_flight{0}, posted{1}, next_send{0}, full_since{0},
+      next_rail{0},
+      stripe_seq{0}, stripe_start{0}, stripe_elements{0}, publishing{0} {
+    uint64_t session = std::random_device{}();
+    session = session << 32 | std::random_device{}();
+
+    size_t ncqe = opt.tx_depth;
+    size_t max_send_wr = opt.tx_depth;
+    if (opt.rails > 1) {
+        rails.resize(opt.rails);
+        /* rail 0 also carries two publishing WRs per stripe */
+        ncqe += opt.tx_depth * opt.rails;
+        max_send_wr += 2 * opt.tx_depth * opt.rails;
+    }
+    id = connect(opt, 0, session, ncqe, max_send_wr, cq, server_conn_data);
+
+    if (opt.direct) {
+        /* client memory does not depend on the ring size */
+        index.reset(new ProducerIndex{server_conn_data.size});
+        seps[0].header(opt.size.value);
+        seps[1].footer();
+        LOG_ERR_EXIT(!(seps_mr = ibv_reg_mr(id->pd, seps, sizeof(seps),
+                                            IBV_ACCESS_LOCAL_WRITE)),
+                     errno, std::system_category());
+        buffers.resize(opt.tx_depth * opt.size.value);
+        LOG_ERR_EXIT(!(buffers_mr = ibv_reg_mr(id->pd, buffers.data(),
+                                               buffers.size(),
+                                               IBV_ACCESS_LOCAL_WRITE)),
+                     errno, std::system_category());
+
+        sge[0].addr = reinterpret_cast<uint64_t>(&seps[0]);
+        sge[0].length = sizeof(seps[0]);
+        sge[0].lkey = seps_mr->lkey;
+        sge[1].length = opt.size.value;
+        sge[1].lkey = buffers_mr->lkey;
+        sge[2].addr = reinterpret_cast<uint64_t>(&seps[1]);
+        sge[2].length = sizeof(seps[1]);
+        sge[2].lkey = seps_mr->lkey;
+        wr.num_sge = 3;
+    } else {
+        mem = std::make_shared<bounded_queue::Memory>(server_conn_data.size);
+        if (opt.hugepages) {
+            LOG_ERR_EXIT(madvise(mem->raw(), mem->raw_size(), MADV_HUGEPAGE),
+                         errno, std::system_category());
+        }
+        memset(mem->raw(), 0, mem->size());
+
+        LOG_ERR_EXIT(
+            !(mr = ibv_reg_mr(id->pd, mem->raw(), mem->raw_size(),
+                              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                                  IBV_ACCESS_REMOTE_READ |
+                                  IBV_ACCESS_REMOTE_ATOMIC)),
+            errno, std::system_category());
+
+        prod.reset(new Producer{mem});
+        sge[0].lkey = mr->lkey;
+        wr.num_sge = 1;
+    }
+
+    wr.wr_id = 0;
+    wr.sg_list = sge;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = opt.inline_data ? IBV_SEND_INLINE : 0;
+    wr.wr.rdma.rkey = server_conn_data.rkey;
+    wr.next = nullptr;
+
+    in_flight_times.resize(opt.tx_depth);
+    times_iter = in_flight_times.begin();
+
+    if (rails.empty()) {
+        return;
+    }
+    rails[0] = {id, cq, server_conn_data.rkey, mr, 0};
+    for (size_t i = 1; i < rails.size(); i++) {
+        Rail& r = rails[i];
+        ServerConnectionData rail_data;
+        r.id = connect(opt, i, session, opt.tx_depth, opt.tx_depth, r.cq,
+                       rail_data);
+        r.rkey = rail_data.rkey;
+        r.in_flight = 0;
+        if (r.id->pd == id->pd) {
+            r.mr = mr;
+        } else {
+            LOG_ERR_EXIT(!(r.mr = ibv_reg_mr(r.id->pd, mem->raw(),
+                                             mem->raw_size(),
+                                             IBV_ACCESS_LOCAL_WRITE)),
+                         errno, std::system_category());
+        }
+    }
+    /* published header/footer of every stripe, written by rail 0 */
+    seps[0].header(opt.size.value);
+    seps[1].footer();
+    LOG_ERR_EXIT(!(seps_mr = ibv_reg_mr(id->pd, seps, sizeof(seps),
+                                        IBV_ACCESS_LOCAL_WRITE)),
+                 errno, std::system_category());
+}
+
+/* Per worker counters, only ever written by the worker itself. The reporter
+ * drains them once a second. Padded so two workers never share a line. */
+struct Stats {
+    char pad0_[bounded_queue::cache_line];
+    std::atomic<uint64_t> operations{0};
+    std::atomic<std::vector<uint64_t>*> times{nullptr};
+    /* elements landed per rail (--rails) */
+    std::unique_ptr<std::atomic<uint64_t>[]> rails;
+    char pad1_[bounded_queue::cache_line];
+};
+
+/* a thread driving its own set of connections */
+struct Worker {
+    Stats stats;
+    /* owned by the reporter */
+    std::vector<uint64_t>* other_times;
+    std::vector<std::unique_ptr<Connection>> connections;
+};
+
+static void pin(std::thread& thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret;
+    LOG_ERR_EXIT((ret = pthread_setaffinity_np(thread.native_handle(),
+                                               sizeof(set), &set)),
+                 ret, std::system_category());
+}
+
+/* wr_id of the WR publishing a stripe, the low bits count its elements */
+constexpr uint64_t publish_wr = uint64_t{1} << 63;
+
+/* With --rails the mirror is written in stripes of about --stripe bytes,
+ * round robin over the rails. A stripe is sent without its first header so
+ * the consumer cannot run into it while it is in flight, and stripes on
+ * different QPs may land in any order. Once a stripe and all stripes before
+ * it have landed, rail 0 writes its final footer and then its first header,
+ * in that order, which hands the stripe to the consumer. */
+static void striped(const Options& opt, Connection& c, Stats& stats,
+                    ibv_wc* wc) {
+    size_t tx_depth = opt.tx_depth;
+    using Index = bounded_queue::Index;
+    auto remote = [&](Index idx) {
+        return c.server_conn_data.address + (idx % c.server_conn_data.size);
+    };
+
+    /* 1. fill the current stripe and post it */
+    while (c.rails[c.next_rail].in_flight < tx_depth) {
+        uint64_t t = TRACE_NOW();
+        auto e = c.prod->produce(opt.size.value, c.back);
+        TRACE_COMPLETE("produce", t);
+        if (e) {
+            if (opt.stamp) {
+                uint64_t ts = timestamp_ns();
+                memcpy(e.data(), &ts, sizeof(ts));
+            }
+            c.stripe_elements++;
+        }
+        if (!c.stripe_elements) {
+            break;
+        }
+        Index end = c.prod->front();
+        if (e && end - c.stripe_start < opt.stripe) {
+            continue;
+        }
+        /* full stripe, or a partial one because the ring is full */
+        Connection::Rail& r = c.rails[c.next_rail];
+        Index first = c.stripe_start + sizeof(Separator);
+        ibv_sge sge;
+        sge.addr = reinterpret_cast<uint64_t>(c.mem->at(first));
+        sge.length = end - first;
+        sge.lkey = r.mr->lkey;
+        ibv_send_wr wr = {};
+        wr.wr_id = c.stripe_seq + c.stripes.size();
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = remote(first);
+        wr.wr.rdma.rkey = r.rkey;
+        ibv_send_wr* bad_wr;
+        int ret;
+        t = TRACE_NOW();
+        LOG_ERR_EXIT((ret = ibv_post_send(r.id->qp, &wr, &bad_wr)), ret,
+                     std::system_category());
+        TRACE_COMPLETE("ibv_post_send stripe", t);
+        r.in_flight++;
+        c.stripes.push_back({c.stripe_start, end, c.stripe_elements, false});
+        c.stripe_start = end;
+        c.stripe_elements = 0;
+        c.next_rail = (c.next_rail + 1) % c.rails.size();
+        if (!e) {
+            break;
+        }
+    }
+
+    /* 2. poll */
+    for (size_t i = 0; i < c.rails.size(); i++) {
+        Connection::Rail& r = c.rails[i];
+        uint64_t t = TRACE_NOW();
+        int polled;
+        LOG_ERR_EXIT(((polled = ibv_poll_cq(r.cq, tx_depth, wc)) < 0), errno,
+                     std::system_category());
+        if (polled) {
+            TRACE_COMPLETE("ibv_poll_cq", t);
+        }
+        for (int j = 0; j < polled; j++) {
+            LOG_ERR_EXIT(wc[j].status != IBV_WC_SUCCESS, wc[j].status,
+                         ibv_wc_error_category());
+            if (wc[j].wr_id & publish_wr) {
+                stats.operations.fetch_add(wc[j].wr_id & ~publish_wr,
+                                           std::memory_order_relaxed);
+                c.publishing--;
+                continue;
+            }
+            auto& stripe = c.stripes[wc[j].wr_id - c.stripe_seq];
+            stripe.landed = true;
+            stats.rails[i].fetch_add(stripe.elements,
+                                     std::memory_order_relaxed);
+            r.in_flight--;
+        }
+    }
+
+    /* 3. publish landed stripes in order */
+    while (!c.stripes.empty() && c.stripes.front().landed &&
+           c.publishing < tx_depth * c.rails.size()) {
+        const auto& stripe = c.stripes.front();
+        ibv_sge sge[2];
+        ibv_send_wr wr[2] = {};
+        for (size_t i = 0; i < 2; i++) {
+            sge[i].lkey = c.seps_mr->lkey;
+            sge[i].length = sizeof(Separator);
+            wr[i].sg_list = &sge[i];
+            wr[i].num_sge = 1;
+            wr[i].opcode = IBV_WR_RDMA_WRITE;
+            wr[i].wr.rdma.rkey = c.server_conn_data.rkey;
+        }
+        sge[0].addr = reinterpret_cast<uint64_t>(&c.seps[1]);
+        wr[0].wr.rdma.remote_addr = remote(stripe.end);
+        wr[0].next = &wr[1];
+        sge[1].addr = reinterpret_cast<uint64_t>(&c.seps[0]);
+        wr[1].wr.rdma.remote_addr = remote(stripe.start);
+        wr[1].wr_id = publish_wr | stripe.elements;
+        wr[1].send_flags = IBV_SEND_SIGNALED;
+        ibv_send_wr* bad_wr;
+        int ret;
+        TRACE_SCOPE("publish stripe");
+        LOG_ERR_EXIT((ret = ibv_post_send(c.id->qp, wr, &bad_wr)), ret,
+                     std::system_category());
+        c.publishing++;
+        c.stripes.pop_front();
+        c.stripe_seq++;
+    }
+}
+
+static void run(const Options& opt, Worker& worker,
+                const std::atomic<bool>& done) {
+    size_t tx_depth = opt.tx_depth;
+    size_t cq_mod = opt.cq_mod;
+    Stats& stats = worker.stats;
+    ibv_wc* wc = new ibv_wc[tx_depth];
+
+    /* Open loop: element k is due at next_send regardless of how fast the
+     * server drains the ring. Latency is taken from that intended time, so
+     * queueing behind a full ring or tx queue is accounted for instead of
+     * silently lowering the offered load (coordinated omission). */
+    bool open_loop = opt.rate > 0;
+    std::mt19937_64 rng{std::random_device{}()};
+    std::exponential_distribution<double> exp_dist{open_loop ? opt.rate : 1};
+    double interval = open_loop ? 1e9 / opt.rate : 0;
+    auto next_interval = [&]() -> double {
+        if (opt.arrival == Arrival::POISSON) {
+            return exp_dist(rng) * 1e9;
+        }
+        return interval;
+    };
+    uint64_t start = now_ns();
+    for (auto& conn : worker.connections) {
+        conn->next_send = next_interval();
+    }
+
+    while (!done.load(std::memory_order_relaxed)) {
+        for (auto& conn : worker.connections) {
+            Connection& c = *conn;
+            if (!c.rails.empty()) {
+                striped(opt, c, stats, wc);
+                continue;
+            }
+            uint64_t now = open_loop ? now_ns() : 0;
+
+            /* 1. post */
+            while (c.in_flight < tx_depth) {
+                if (open_loop &&
+                    start + static_cast<uint64_t>(c.next_send) > now) {
+                    break;
+                }
+                bounded_queue::Index idx;
+                void* payload;
+                uint64_t t = TRACE_NOW();
+                if (c.prod) {
+                    auto e = c.prod->produce(opt.size.value, c.back);
+                    if (!e) {
+                        /* ring full, serve the other connections */
+                        if (!c.full_since) {
+                            c.full_since = TRACE_NOW();
+                        }
+                        break;
+                    }
+                    /* local location */
+                    c.sge[0].addr = reinterpret_cast<uint64_t>(e.get());
+                    c.sge[0].length = e.raw_size();
+                    idx = e.idx();
+                    payload = e.data();
+                } else {
+                    if (!c.index->reserve(opt.size.value, c.back, idx)) {
+                        if (!c.full_since) {
+                            c.full_since = TRACE_NOW();
+                        }
+                        break;
+                    }
+                    /* header and footer come from the scratch seps */
+                    payload = &c.buffers[(c.posted % tx_depth) *
+                                         opt.size.value];
+                    c.sge[1].addr = reinterpret_cast<uint64_t>(payload);
+                }
+                TRACE_COMPLETE("produce", t);
+                if (c.full_since) {
+                    TRACE_COMPLETE("wait back", c.full_since);
+                    c.full_since = 0;
+                }
+                /* remote location */
+                c.wr.wr.rdma.remote_addr =
+                    c.server_conn_data.address +
+                    (idx % c.server_conn_data.size);
+                if (c.posted % cq_mod == 0) {
+                    c.wr.send_flags |= IBV_SEND_SIGNALED;
+                } else {
+                    c.wr.send_flags &= ~IBV_SEND_SIGNALED;
+                }
+                if (opt.stamp) {
+                    uint64_t ts = timestamp_ns();
+                    memcpy(payload, &ts, sizeof(ts));
+                }
+                ibv_send_wr* bad_wr;
+                int ret;
+                if (opt.type == Type::LAT) {
+                    if (c.times_iter == c.in_flight_times.end()) {
+                        c.times_iter = c.in_flight_times.begin();
+                    }
+                    *c.times_iter++ =
+                        open_loop ? start + static_cast<uint64_t>(c.next_send)
+                                  : now_ns();
+                }
+                c.wr.wr_id =
+                    std::distance(c.in_flight_times.begin(), c.times_iter) - 1;
+                t = TRACE_NOW();
+                LOG_ERR_EXIT((ret = ibv_post_send(c.id->qp, &c.wr, &bad_wr)),
+                             ret, std::system_category());
+                TRACE_COMPLETE("ibv_post_send", t);
+                c.posted++;
+                c.in_flight++;
+                if (open_loop) {
+                    c.next_send += next_interval();
+                }
+            }
+
+            /* 2. poll */
+            uint64_t t = TRACE_NOW();
+            int polled;
+            LOG_ERR_EXIT(((polled = ibv_poll_cq(c.cq, tx_depth, wc)) < 0),
+                         errno, std::system_category());
+            if (polled) {
+                TRACE_COMPLETE("ibv_poll_cq", t);
+            }
+            for (int i = 0; i < polled; i++) {
+                LOG_ERR_EXIT(wc[i].status != IBV_WC_SUCCESS, wc[i].status,
+                             ibv_wc_error_category());
+                c.in_flight -= cq_mod;
+                if (opt.type == Type::BW || open_loop) {
+                    stats.operations.fetch_add(cq_mod,
+                                               std::memory_order_relaxed);
+                }
+                if (opt.type == Type::LAT) {
+                    auto times = stats.times.load(std::memory_order_acquire);
+                    if (times->size() < sample_size) {
+                        times->push_back(now_ns() -
+                                         c.in_flight_times[wc[i].wr_id]);
+                    }
+                }
+            }
+        }
+    }
+    delete[] wc;
+}
+
 int main(int argc, char* argv[]) {
     namespace bop = boost::program_options;
 
@@ -64,7 +668,25 @@ int main(int argc, char* argv[]) {
         ("i", bop::value<size_t>()->default_value(0),
          "inline data size (bytes)")
         ("s", bop::value<Bytes>()->default_value({8}), "size")
-        ("h", "enable hugepages (madvise)");
+        ("h", "enable hugepages (madvise)")
+        ("n", bop::value<size_t>()->default_value(1), "worker threads")
+        ("c", bop::value<size_t>()->default_value(1),
+         "connections per worker")
+        ("cpu", bop::value<int>()->default_value(-1),
+         "pin worker i to core cpu + i (-1 = no pinning)")
+        ("rate", bop::value<double>()->default_value(0),
+         "open loop: offered ops/sec over all connections (0 = closed loop)")
+        ("arrival", bop::value<Arrival>()->default_value(Arrival::FIXED),
+         "open loop schedule: fixed/poisson")
+        ("stamp", "stamp send time into payload (server --handler latency), "
+         "same host only")
+        ("direct", "send from application buffers, no local ring mirror")
+        ("rails", bop::value<size_t>()->default_value(1),
+         "QPs per connection striping the same ring (bw only)")
+        ("stripe", bop::value<Bytes>()->default_value({64 * 1024}),
+         "bytes per stripe with --rails")
+        ("src", bop::value<std::vector<psl::net::in_addr>>()->multitoken(),
+         "local addresses (devices/ports) for the rails, round robin");
     // clang-format on
 
     bop::positional_options_description p;
@@ -82,103 +704,66 @@ int main(int argc, char* argv[]) {
     }
     bop::notify(vm);
 
-    rdma_cm_id* id;
-    LOG_ERR_EXIT(rdma_create_id(nullptr, &id, nullptr, RDMA_PS_TCP), errno,
-                 std::system_category());
-
-    psl::net::in_addr ip = vm["ip"].as<psl::net::in_addr>();
-    psl::net::in_port_t port = vm["p"].as<psl::net::in_port_t>();
-    sockaddr_in addr;
-    addr.sin_addr = ip;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-
-    LOG_ERR_EXIT(
-        rdma_resolve_addr(id, NULL, reinterpret_cast<sockaddr*>(&addr), 1000),
-        errno, std::system_category());
-
-    LOG_ERR_EXIT(rdma_resolve_route(id, 1000), errno, std::system_category());
-
-    size_t tx_depth = vm["tx"].as<size_t>();
-    size_t ncqe = tx_depth;
-    ibv_cq* cq;
-    LOG_ERR_EXIT(!(cq = ibv_create_cq(id->verbs, ncqe, NULL, NULL, 0)), errno,
-                 std::system_category());
-
-    Bytes size = vm["s"].as<Bytes>();
-    size_t inline_data = vm["i"].as<size_t>();
-    LOG_ERR_EXIT(inline_data && inline_data < size.value, EINVAL,
-                 std::system_category());
-    ibv_qp_init_attr qp_init_attr = {};
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.sq_sig_all = 0;
-    qp_init_attr.send_cq = cq;
-    qp_init_attr.recv_cq = cq;
-    qp_init_attr.cap.max_inline_data = inline_data;
-    qp_init_attr.cap.max_recv_wr = 1;
-    qp_init_attr.cap.max_send_wr = tx_depth;
-    qp_init_attr.cap.max_recv_sge = 1;
-    qp_init_attr.cap.max_send_sge = 1;
-    LOG_ERR_EXIT(rdma_create_qp(id, id->pd, &qp_init_attr), errno,
-                 std::system_category());
-
-    ibv_device_attr dev_attr;
-    LOG_ERR_EXIT(ibv_query_device(id->verbs, &dev_attr), errno,
+    Options opt;
+    opt.ip = vm["ip"].as<psl::net::in_addr>();
+    opt.port = vm["p"].as<psl::net::in_port_t>();
+    opt.tx_depth = vm["tx"].as<size_t>();
+    opt.cq_mod = vm["cq_mod"].as<size_t>();
+    opt.size = vm["s"].as<Bytes>();
+    opt.inline_data = vm["i"].as<size_t>();
+    LOG_ERR_EXIT(opt.inline_data && opt.inline_data < opt.size.value, EINVAL,
                  std::system_category());
-
-    volatile uint64_t back{0};
-    ibv_mr* back_mr;
-    LOG_ERR_EXIT(!(back_mr = ibv_reg_mr(
-                       id->pd, (void*)(&back), sizeof(back),
-                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
-                           IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC)),
-                 errno, std::system_category());
-
-    ClientConnectionData conn_data;
-    conn_data.address = reinterpret_cast<uint64_t>(&back);
-    conn_data.rkey = back_mr->rkey;
-    rdma_conn_param conn_param = {};
-    conn_param.private_data = reinterpret_cast<void*>(&conn_data);
-    conn_param.private_data_len = sizeof(conn_data);
-    conn_param.responder_resources = dev_attr.max_qp_rd_atom;
-    conn_param.initiator_depth = dev_attr.max_qp_rd_atom;
-    LOG_ERR_EXIT(rdma_connect(id, &conn_param), errno, std::system_category());
-
-    LOG_ERR_EXIT(id->event->param.conn.private_data_len <
-                     sizeof(ServerConnectionData),
-                 EINVAL, std::system_category());
-    ServerConnectionData server_conn_data =
-        *reinterpret_cast<const ServerConnectionData*>(
-            id->event->param.conn.private_data);
-
-    auto mem = std::make_shared<bounded_queue::Memory>(server_conn_data.size);
-    if (vm.count("h")) {
-        LOG_ERR_EXIT(madvise(mem->raw(), mem->raw_size(), MADV_HUGEPAGE), errno,
-                     std::system_category());
+    opt.hugepages = vm.count("h");
+    opt.type = vm["t"].as<Type>();
+    opt.stamp = vm.count("stamp");
+    opt.direct = vm.count("direct");
+    opt.rails = vm["rails"].as<size_t>();
+    opt.stripe = vm["stripe"].as<Bytes>().value;
+    if (vm.count("src")) {
+        opt.srcs = vm["src"].as<std::vector<psl::net::in_addr>>();
     }
-    memset(mem->raw(), 0, mem->size());
-
-    ibv_mr* mr;
-    LOG_ERR_EXIT(!(mr = ibv_reg_mr(
-                       id->pd, mem->raw(), mem->raw_size(),
-                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
-                           IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC)),
-                 errno, std::system_category());
+    /* stripes are sent from the mirror and published as a whole */
+    LOG_ERR_EXIT(!opt.rails || (opt.rails > 1 && (opt.direct ||
+                                                  opt.type != Type::BW ||
+                                                  opt.inline_data)),
+                 EINVAL, std::system_category());
+    LOG_ERR_EXIT(opt.stamp && opt.size.value < sizeof(uint64_t), EINVAL,
+                 std::system_category());
 
-    Type type = vm["t"].as<Type>();
-    std::atomic<std::vector<uint64_t>*> times{new std::vector<uint64_t>()};
-    if (type == Type::LAT) {
-        times.load()->reserve(sample_size);
+    TRACE_START("bq_client");
+
+    size_t nworkers = vm["n"].as<size_t>();
+    size_t nconnections = vm["c"].as<size_t>();
+    LOG_ERR_EXIT(!nworkers || !nconnections, EINVAL, std::system_category());
+    double rate = vm["rate"].as<double>();
+    LOG_ERR_EXIT(rate < 0, EINVAL, std::system_category());
+    LOG_ERR_EXIT(rate > 0 && opt.rails > 1, EINVAL, std::system_category());
+    opt.rate = rate / (nworkers * nconnections);
+    opt.arrival = vm["arrival"].as<Arrival>();
+    std::vector<Worker> workers(nworkers);
+    for (auto& worker : workers) {
+        worker.stats.times = new std::vector<uint64_t>();
+        worker.other_times = new std::vector<uint64_t>();
+        worker.stats.rails.reset(new std::atomic<uint64_t>[opt.rails]);
+        for (size_t i = 0; i < opt.rails; i++) {
+            worker.stats.rails[i] = 0;
+        }
+        if (opt.type == Type::LAT) {
+            worker.stats.times.load()->reserve(sample_size);
+            worker.other_times->reserve(sample_size);
+        }
+        for (size_t i = 0; i < nconnections; i++) {
+            worker.connections.emplace_back(new Connection{opt});
+        }
     }
-    std::atomic<uint64_t> operations{0};
 
     size_t duration = vm["d"].as<size_t>();
-    bool done = false;
+    std::atomic<bool> done{false};
     std::thread time_thread([&]() {
         using namespace std::chrono;
-        auto other_times = new std::vector<uint64_t>();
-        if (type == Type::LAT) {
-            other_times->reserve(sample_size);
+        std::vector<uint64_t> merged;
+        if (opt.type == Type::LAT) {
+            merged.reserve(sample_size * workers.size());
         }
 
         seconds sec{0};
@@ -199,119 +784,78 @@ int main(int argc, char* argv[]) {
             strftime(buf, sizeof(buf), "%d.%m.%y %X", tmnow);
             std::cout << buf << "." << std::setfill('0') << std::setw(9)
                       << ns.count() << "\t";
-            if (type == Type::BW) {
+            if (opt.type == Type::BW) {
                 using namespace psl::terminal;
-                auto i = operations.exchange(0);
+                uint64_t i = 0;
+                for (auto& worker : workers) {
+                    i += worker.stats.operations.exchange(0);
+                }
                 std::cout << graphic_format::GREEN << graphic_format::BOLD
                           << "throughput = " << graphic_format::WHITE << i
-                          << " ops/sec\n" << graphic_format::RESET;
-            } else if (type == Type::LAT) {
+                          << " ops/sec" << graphic_format::RESET;
+                if (rate > 0) {
+                    std::cout << " (offered = " << rate << " ops/sec)";
+                }
+                if (opt.rails > 1) {
+                    std::cout << " rails =";
+                    for (size_t r = 0; r < opt.rails; r++) {
+                        uint64_t n = 0;
+                        for (auto& worker : workers) {
+                            n += worker.stats.rails[r].exchange(0);
+                        }
+                        std::cout << " " << n;
+                    }
+                }
+                std::cout << '\n';
+            } else if (opt.type == Type::LAT) {
                 using namespace psl::terminal;
-                other_times->clear();
-                other_times = times.exchange(other_times);
-                std::sort(other_times->begin(), other_times->end());
+                merged.clear();
+                for (auto& worker : workers) {
+                    worker.other_times->clear();
+                    worker.other_times =
+                        worker.stats.times.exchange(worker.other_times);
+                    merged.insert(merged.end(), worker.other_times->begin(),
+                                  worker.other_times->end());
+                }
+                std::sort(merged.begin(), merged.end());
                 std::cout << graphic_format::GREEN << graphic_format::BOLD
                           << "median = " << graphic_format::WHITE
-                          << psl::stats::median(other_times->begin(),
-                                                other_times->end()) << "ns"
-                          << graphic_format::GREEN
+                          << psl::stats::median(merged.begin(), merged.end())
+                          << "ns" << graphic_format::GREEN
                           << " average = " << graphic_format::WHITE
-                          << psl::stats::mean(other_times->begin(),
-                                              other_times->end()) << "ns"
-                          << graphic_format::RESET
-                          << " (sample size = " << other_times->size() << ")\n";
+                          << psl::stats::mean(merged.begin(), merged.end())
+                          << "ns" << graphic_format::RESET
+                          << " (sample size = " << merged.size() << ")";
+                if (rate > 0) {
+                    uint64_t i = 0;
+                    for (auto& worker : workers) {
+                        i += worker.stats.operations.exchange(0);
+                    }
+                    std::cout << " achieved = " << i
+                              << " ops/sec offered = " << rate << " ops/sec";
+                }
+                std::cout << '\n';
             }
         }
         done = true;
     });
 
-    Producer prod{mem};
-
-    ibv_send_wr wr;
-    wr.wr_id = 0;
-    ibv_sge sge;
-    sge.lkey = mr->lkey;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.opcode = IBV_WR_RDMA_WRITE;
-    wr.send_flags = inline_data ? IBV_SEND_INLINE : 0;
-    wr.wr.rdma.rkey = server_conn_data.rkey;
-    wr.next = nullptr;
-
-    size_t cq_mod = vm["cq_mod"].as<size_t>();
-    size_t in_flight = 0;
-    size_t posted = 1;
-    ibv_wc* wc = new ibv_wc[tx_depth];
-    std::vector<uint64_t> in_flight_times;
-    in_flight_times.resize(tx_depth);
-    auto times_iter = in_flight_times.begin();
-    while (true) {
-
-        /* 1. post */
-        while (in_flight < tx_depth) {
-            auto e = prod.produce(size.value, back);
-            if (!e) {
-                continue;
-            }
-            // std::cout << e.get() << '\n';
-            /* local location */
-            sge.addr = reinterpret_cast<uint64_t>(e.get());
-            sge.length = e.raw_size();
-            /* remote location */
-            wr.wr.rdma.remote_addr =
-                server_conn_data.address + (e.idx() % mem->size());
-            if (posted % cq_mod == 0) {
-                wr.send_flags |= IBV_SEND_SIGNALED;
-            } else {
-                wr.send_flags &= ~IBV_SEND_SIGNALED;
-            }
-            ibv_send_wr* bad_wr;
-            int ret;
-            if (type == Type::LAT) {
-                if (times_iter == in_flight_times.end()) {
-                    times_iter = in_flight_times.begin();
-                }
-                using namespace std::chrono;
-                auto now = high_resolution_clock::now();
-                *times_iter++ =
-                    duration_cast<nanoseconds>(now.time_since_epoch()).count();
-            }
-            wr.wr_id = std::distance(in_flight_times.begin(), times_iter) - 1;
-            LOG_ERR_EXIT((ret = ibv_post_send(id->qp, &wr, &bad_wr)), ret,
-                         std::system_category());
-            posted++;
-            in_flight++;
+    int cpu = vm["cpu"].as<int>();
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&]() { run(opt, worker, done); });
+        if (cpu >= 0) {
+            pin(threads.back(), cpu++);
         }
+    }
 
-        /* 2. poll */
-        int polled;
-        do {
-            LOG_ERR_EXIT(((polled = ibv_poll_cq(cq, tx_depth, wc)) < 0), errno,
-                         std::system_category());
-            if (done) {
-                goto end;
-            }
-        } while (polled == 0);
-        for (int i = 0; i < polled; i++) {
-            LOG_ERR_EXIT(wc[i].status != IBV_WC_SUCCESS, wc[i].status,
-                         ibv_wc_error_category());
-            in_flight -= cq_mod;
-            if (type == Type::BW) {
-                operations += cq_mod;
-            } else if (type == Type::LAT) {
-                if (times.load()->size() < sample_size) {
-                    using namespace std::chrono;
-                    auto now = high_resolution_clock::now();
-                    times.load()->push_back(
-                        duration_cast<nanoseconds>(now.time_since_epoch())
-                            .count() -
-                        in_flight_times[wc[i].wr_id]);
-                }
-            }
-        }
+    for (auto& thread : threads) {
+        thread.join();
     }
-end:
     time_thread.join();
-    delete[] wc;
+    for (auto& worker : workers) {
+        delete worker.stats.times.load();
+        delete worker.other_times;
+    }
     return 0;
 }
@@ -6,9 +6,21 @@
 #include <cstdint>
 #include <cstddef>
 #include <cassert>
+#include <ctime>
 
 constexpr uint16_t default_port = 20123;
 
+/* Timestamp written into each payload by bq_client --stamp and read back by
+ * bq_server --handler latency. CLOCK_MONOTONIC_RAW is neither synchronized
+ * nor slewed between hosts, so one-way latencies are only meaningful with
+ * client and server on the same host (loopback or two ports of one box).
+ * Across hosts the result is off by the unknown, drifting clock offset. */
+inline uint64_t timestamp_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 struct ServerConnectionData {
     uint64_t address;
     /* queue size! */
@@ -19,6 +31,9 @@ struct ServerConnectionData {
 struct ClientConnectionData {
     uint64_t address;
     uint32_t rkey;
+    /* all rails of a session write the same ring, rail 0 opens it */
+    uint32_t rail;
+    uint64_t session;
 };
 
 struct Bytes {
@@ -1,15 +1,23 @@
 #include <iostream>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
 
 #include <thread>
 
 #include <bounded_queue.h>
 
-int main() {
-    using namespace bounded_queue;
+using namespace bounded_queue;
+using Separator = Sep<uint32_t>;
+
+constexpr size_t ring_size = 4096 * 16;
+
+static void demo() {
     auto mem = std::make_shared<Memory>(4096*10);
     std::cout << mem->size() << '\n';
-    Producer<Sep<uint32_t>> p{mem};
+    Producer<Separator> p{mem};
 
     size_t n = 1025;
     volatile Index back = 0;
@@ -22,7 +30,7 @@ int main() {
     }
 
     Index old_back = back;
-    Consumer<Sep<uint32_t>> c{mem};
+    Consumer<Separator> c{mem};
     for (size_t i = 0; i < n; i++) {
         auto e = c.consume();
         if (e) {
@@ -33,5 +41,91 @@ int main() {
             }
         }
     }
+}
+
+/* producer reads the consumer's back on every produce, consumer reads the
+ * producer's front on every consume */
+static void fresh(size_t n) {
+    auto mem = std::make_shared<Memory>(ring_size);
+    memset(mem->raw(), 0, mem->size());
+    auto idx = std::make_shared<LocalIndices>();
+
+    std::thread consumer{[&]() {
+        Consumer<Separator> c{mem};
+        for (size_t i = 0; i < n;) {
+            if (c.back() == idx->front.load(std::memory_order_acquire)) {
+                continue;
+            }
+            auto e = c.consume();
+            if (!e || *e.data<uint64_t>() != i) {
+                std::abort();
+            }
+            idx->back.store(c.back(), std::memory_order_release);
+            i++;
+        }
+    }};
+
+    Producer<Separator> p{mem};
+    for (size_t i = 0; i < n;) {
+        auto e = p.produce(8, idx->back.load(std::memory_order_acquire));
+        if (!e) {
+            continue;
+        }
+        *e.data<uint64_t>() = i++;
+        idx->front.store(p.front(), std::memory_order_release);
+    }
+    consumer.join();
+}
+
+/* same, but both sides only reload the shared index when their cached copy
+ * says full/empty */
+static void cached(size_t n) {
+    auto mem = std::make_shared<Memory>(ring_size);
+    memset(mem->raw(), 0, mem->size());
+    auto idx = std::make_shared<LocalIndices>();
+
+    std::thread consumer{[&]() {
+        LocalConsumer<Separator> c{mem, idx};
+        for (size_t i = 0; i < n;) {
+            auto e = c.consume();
+            if (!e) {
+                continue;
+            }
+            if (*e.data<uint64_t>() != i) {
+                std::abort();
+            }
+            c.release();
+            i++;
+        }
+    }};
+
+    LocalProducer<Separator> p{mem, idx};
+    for (size_t i = 0; i < n;) {
+        auto e = p.produce(8);
+        if (!e) {
+            continue;
+        }
+        *e.data<uint64_t>() = i++;
+        p.publish();
+    }
+    consumer.join();
+}
+
+template <class F> static void bench(const char* name, F f, size_t n) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    f(n);
+    auto sec = duration_cast<duration<double>>(steady_clock::now() - start);
+    std::cout << name << ": " << n / sec.count() / 1e6 << " Mops/sec\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string{argv[1]} == "demo") {
+        demo();
+        return 0;
+    }
+    size_t n = argc > 1 ? std::stoull(argv[1]) : 100000000;
+    bench("fresh index ", fresh, n);
+    bench("cached index", cached, n);
     return 0;
 }
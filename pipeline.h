@@ -0,0 +1,166 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <bounded_queue.h>
+#include <spsc.h>
+#include <trace.h>
+
+namespace bounded_queue {
+
+template <class Separator> class Handler {
+  public:
+    virtual ~Handler() {}
+    /* Elements point into the ring and stay valid until handle() returns.
+     * With worker threads handle() is called concurrently. */
+    virtual void handle(const Element<Separator>* elements, size_t n) = 0;
+};
+
+/* Consumes a ring in batches and runs a Handler on them, either inline or
+ * on a pool of worker threads fed through local SPSC rings. Elements are
+ * never copied out of the ring, poll() returns how far the ring has been
+ * handled and may be handed back to the producer. */
+template <class Separator> class Pipeline {
+  private:
+    /* batches in flight per worker */
+    static constexpr size_t depth = 8;
+
+    using Batch = std::vector<Element<Separator>>;
+
+    struct Worker {
+        Spsc<Batch*> queue{depth};
+        std::vector<Batch> slots;
+        uint64_t dispatched{0};
+        std::atomic<uint64_t> done{0};
+        std::thread thread;
+    };
+
+    struct Pending {
+        Worker* worker;
+        uint64_t seq;
+        Index end;
+    };
+
+    std::shared_ptr<Memory> mem_;
+    Consumer<Separator> consumer_;
+    Handler<Separator>& handler_;
+    size_t batch_;
+    size_t prefetch_;
+    Batch inline_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    size_t next_worker_;
+    /* dispatched batches in ring order */
+    std::deque<Pending> pending_;
+    Index released_;
+    std::atomic<bool> stop_;
+
+    size_t collect(Batch& batch) {
+        uint64_t t = TRACE_NOW();
+        batch.clear();
+        while (batch.size() < batch_) {
+            auto e = consumer_.consume();
+            if (!e) {
+                break;
+            }
+            batch.push_back(e);
+        }
+        if (!batch.empty()) {
+            TRACE_COMPLETE("consume", t);
+            /* pull in what follows while this batch is handled */
+            auto next = reinterpret_cast<const char*>(mem_->at(back()));
+            for (size_t off = 0; off < prefetch_; off += cache_line) {
+                __builtin_prefetch(next + off);
+            }
+        }
+        return batch.size();
+    }
+
+    void retire() {
+        while (!pending_.empty()) {
+            const Pending& p = pending_.front();
+            if (p.worker->done.load(std::memory_order_acquire) <= p.seq) {
+                break;
+            }
+            released_ = p.end;
+            pending_.pop_front();
+        }
+    }
+
+    void work(Worker& w) {
+        Batch* batch;
+        while (!stop_.load(std::memory_order_relaxed)) {
+            if (w.queue.pop(batch)) {
+                TRACE_SCOPE("handle");
+                handler_.handle(batch->data(), batch->size());
+                w.done.store(w.done.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_release);
+            }
+        }
+    }
+
+  public:
+    Pipeline(std::shared_ptr<Memory> mem, Handler<Separator>& handler,
+             size_t batch, size_t workers, size_t prefetch)
+        : mem_{mem}, consumer_{mem}, handler_{handler},
+          batch_{batch ? batch : 1}, prefetch_{std::min(prefetch, mem->size())},
+          next_worker_{0}, released_{consumer_.back()}, stop_{false} {
+        inline_.reserve(batch_);
+        for (size_t i = 0; i < workers; i++) {
+            workers_.emplace_back(new Worker);
+            Worker& w = *workers_.back();
+            w.slots.resize(depth);
+            for (auto& slot : w.slots) {
+                slot.reserve(batch_);
+            }
+            w.thread = std::thread{[this, &w]() { work(w); }};
+        }
+    }
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    ~Pipeline() {
+        stop_ = true;
+        for (auto& w : workers_) {
+            w->thread.join();
+        }
+    }
+
+    /* consume and dispatch at most one batch */
+    Index poll() {
+        if (workers_.empty()) {
+            if (collect(inline_)) {
+                TRACE_SCOPE("handle");
+                handler_.handle(inline_.data(), inline_.size());
+                released_ = back();
+            }
+            return released_;
+        }
+
+        retire();
+        Worker& w = *workers_[next_worker_];
+        if (w.dispatched - w.done.load(std::memory_order_acquire) < depth) {
+            Batch& batch = w.slots[w.dispatched % depth];
+            if (collect(batch)) {
+                /* cannot fail, at most depth batches are in flight */
+                w.queue.push(&batch);
+                pending_.push_back({&w, w.dispatched, back()});
+                w.dispatched++;
+                next_worker_ = (next_worker_ + 1) % workers_.size();
+            }
+        }
+        return released_;
+    }
+
+    /* consumed, but not necessarily handled yet */
+    Index back() const { return consumer_.back(); }
+};
+}
+
+#endif /* PIPELINE_H */
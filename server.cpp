@@ -3,6 +3,13 @@
 #include <cstdlib>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <string>
+#include <algorithm>
 
 #include <boost/program_options.hpp>
 
@@ -13,16 +20,259 @@
 
 #include <common.h>
 #include <bounded_queue.h>
+#include <pipeline.h>
+#include <trace.h>
 
-using Consumer = bounded_queue::Consumer<bounded_queue::Sep<uint32_t>>;
+using Separator = bounded_queue::Sep<uint32_t>;
+using Element = bounded_queue::Element<Separator>;
+using Handler = bounded_queue::Handler<Separator>;
+using Pipeline = bounded_queue::Pipeline<Separator>;
 
 constexpr int connection_backlog = 128;
 
-struct DeviceContext {
-    ibv_mr& mr;
-    ibv_device_attr dev_attr;
+/* handler that prints its statistics once a second */
+class ReportingHandler : public Handler {
+  public:
+    virtual void report(std::ostream& out) = 0;
 };
 
+/* drops everything, same as a bare consumer */
+class NullHandler : public Handler {
+  public:
+    void handle(const Element*, size_t) override {}
+};
+
+/* reads every payload byte as a stand-in for real processing */
+class ChecksumHandler : public ReportingHandler {
+  private:
+    std::atomic<uint64_t> elements_{0};
+    std::atomic<uint64_t> bytes_{0};
+    std::atomic<uint64_t> sum_{0};
+
+  public:
+    void handle(const Element* elements, size_t n) override {
+        uint64_t sum = 0;
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < n; i++) {
+            auto data = elements[i].data<const unsigned char>();
+            for (size_t j = 0; j < elements[i].size(); j++) {
+                sum += data[j];
+            }
+            bytes += elements[i].size();
+        }
+        elements_.fetch_add(n, std::memory_order_relaxed);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        sum_.fetch_add(sum, std::memory_order_relaxed);
+    }
+
+    void report(std::ostream& out) override {
+        out << "handled " << elements_.exchange(0) << " elements/sec "
+            << bytes_.exchange(0) / (1024 * 1024) << " MiB/sec\n";
+    }
+};
+
+/* log-linear histogram, 2^sub_bits linear buckets per power of two */
+class Histogram {
+  private:
+    static constexpr int sub_bits = 4;
+    static constexpr uint64_t sub_mask = (1 << sub_bits) - 1;
+    static constexpr size_t nbuckets = (64 - sub_bits + 1) << sub_bits;
+    std::atomic<uint64_t> buckets_[nbuckets];
+
+    static size_t index(uint64_t v) {
+        if (v <= sub_mask) {
+            return v;
+        }
+        int shift = 63 - __builtin_clzll(v) - sub_bits;
+        return ((shift + 1) << sub_bits) + ((v >> shift) & sub_mask);
+    }
+
+    static uint64_t lower(size_t i) {
+        if (i <= sub_mask) {
+            return i;
+        }
+        int shift = (i >> sub_bits) - 1;
+        return ((uint64_t{1} << sub_bits) | (i & sub_mask)) << shift;
+    }
+
+  public:
+    Histogram() {
+        for (auto& b : buckets_) {
+            b.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t v) {
+        buckets_[index(v)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* print percentiles since the last report and start over */
+    void report(std::ostream& out) {
+        uint64_t counts[nbuckets];
+        uint64_t total = 0;
+        for (size_t i = 0; i < nbuckets; i++) {
+            counts[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+            total += counts[i];
+        }
+        out << "delivery latency";
+        for (double p : {0.5, 0.99, 0.999, 1.0}) {
+            uint64_t rank = std::max<uint64_t>(1, p * total);
+            uint64_t seen = 0;
+            size_t i = 0;
+            while (i < nbuckets - 1 && (seen += counts[i]) < rank) {
+                i++;
+            }
+            out << " p" << p * 100 << " = " << (total ? lower(i) : 0) << "ns";
+        }
+        out << " (sample size = " << total << ")\n";
+    }
+};
+
+/* One-way latency from the client's --stamp timestamp in the first 8 payload
+ * bytes to the time the batch reaches the handler (see timestamp_ns()). */
+class LatencyHandler : public ReportingHandler {
+  private:
+    Histogram hist_;
+
+  public:
+    void handle(const Element* elements, size_t n) override {
+        uint64_t now = timestamp_ns();
+        for (size_t i = 0; i < n; i++) {
+            uint64_t stamp;
+            if (elements[i].size() < sizeof(stamp)) {
+                continue;
+            }
+            memcpy(&stamp, elements[i].data(), sizeof(stamp));
+            /* clamp clock skew instead of wrapping around */
+            hist_.record(now > stamp ? now - stamp : 0);
+        }
+    }
+
+    void report(std::ostream& out) override { hist_.report(out); }
+};
+
+/* a pre-zeroed, pre-registered ring together with its CQ */
+struct Ring {
+    std::shared_ptr<bounded_queue::Memory> mem;
+    ibv_mr* mr;
+    ibv_cq* cq;
+};
+
+/* Warm pool of rings for one device. Rings are handed out on accept and
+ * recycled (re-zeroed) by the connection thread on disconnect, so the accept
+ * loop never has to allocate, touch or register multi-GB memory. */
+class RingPool {
+  private:
+    ibv_context* verbs_;
+    ibv_pd* pd_;
+    size_t size_;
+    bool hugepages_;
+    int access_;
+    ibv_device_attr dev_attr_;
+    std::mutex mutex_;
+    std::vector<Ring> free_;
+
+    Ring create() {
+        Ring ring;
+        ring.mem = std::make_shared<bounded_queue::Memory>(size_);
+        if (hugepages_) {
+#ifdef MADV_HUGEPAGE
+            LOG_ERR_EXIT(madvise(ring.mem->raw(), ring.mem->raw_size(),
+                                 MADV_HUGEPAGE),
+                         errno, std::system_category());
+#else
+            LOG_ERR_EXIT("no hugepage support!", EINVAL,
+                         std::system_category());
+#endif
+        }
+        memset(ring.mem->raw(), 0, ring.mem->size());
+        LOG_ERR_EXIT(!(ring.mr = ibv_reg_mr(pd_, ring.mem->raw(),
+                                            ring.mem->raw_size(), access_)),
+                     errno, std::system_category());
+        LOG_ERR_EXIT(
+            !(ring.cq = ibv_create_cq(verbs_, 16, nullptr, nullptr, 0)),
+            errno, std::system_category());
+        return ring;
+    }
+
+  public:
+    RingPool(ibv_context* verbs, ibv_pd* pd, size_t size, bool hugepages,
+             bool odp, size_t n)
+        : verbs_{verbs}, pd_{pd}, size_{size}, hugepages_{hugepages},
+          access_{IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                  IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC} {
+        ibv_device_attr_ex attr = {};
+        LOG_ERR_EXIT(ibv_query_device_ex(verbs_, nullptr, &attr), errno,
+                     std::system_category());
+        dev_attr_ = attr.orig_attr;
+        if (odp) {
+            if ((attr.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+                (attr.odp_caps.per_transport_caps.rc_odp_caps &
+                 IBV_ODP_SUPPORT_WRITE)) {
+                /* the client only ever writes into the ring */
+                access_ = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                          IBV_ACCESS_ON_DEMAND;
+            } else {
+                std::cout << "no ODP support on " << verbs_->device->name
+                          << ", pinning rings\n";
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            free_.push_back(create());
+        }
+    }
+
+    /* returns a ring and whether it came from the pool */
+    std::pair<Ring, bool> get() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (!free_.empty()) {
+                Ring ring = free_.back();
+                free_.pop_back();
+                return {ring, true};
+            }
+        }
+        return {create(), false};
+    }
+
+    void put(Ring ring) {
+        ibv_wc wc;
+        int num_wc;
+        do {
+            LOG_ERR_EXIT((num_wc = ibv_poll_cq(ring.cq, 1, &wc)) < 0, errno,
+                         std::system_category());
+        } while (num_wc > 0);
+        memset(ring.mem->raw(), 0, ring.mem->size());
+        std::lock_guard<std::mutex> lock{mutex_};
+        free_.push_back(ring);
+    }
+
+    const ibv_device_attr& dev_attr() const { return dev_attr_; }
+
+    ibv_pd* pd() const { return pd_; }
+};
+
+/* A ring shared by all rails of one client. It goes back to its pool when
+ * the last rail is gone. */
+struct Session {
+    RingPool* pool;
+    Ring ring;
+
+    Session(RingPool* p, Ring r) : pool{p}, ring{r} {}
+    ~Session() { pool->put(ring); }
+};
+
+static void wait_disconnect(rdma_cm_id* id) {
+    bool disconnected = false;
+    while (!disconnected) {
+        rdma_cm_event* event;
+        LOG_ERR_EXIT(rdma_get_cm_event(id->channel, &event), errno,
+                     std::system_category());
+        disconnected = event->event == RDMA_CM_EVENT_DISCONNECTED;
+        rdma_ack_cm_event(event);
+    }
+}
+
 int main(int argc, char* argv[]) {
     namespace bop = boost::program_options;
 
@@ -35,7 +285,18 @@ int main(int argc, char* argv[]) {
         "listen only from this ip")
         ("p", bop::value<psl::net::in_port_t>()->default_value(default_port),
         "listen on port")
-        ("h", "enbale hugepages (madvise)");
+        ("h", "enbale hugepages (madvise)")
+        ("pool", bop::value<size_t>()->default_value(4),
+         "number of pre-registered rings per device")
+        ("odp", "use on-demand paging for rings if supported")
+        ("handler", bop::value<std::string>()->default_value("none"),
+         "element handler (none/checksum/latency)")
+        ("batch", bop::value<size_t>()->default_value(1),
+         "elements per handler invocation")
+        ("workers", bop::value<size_t>()->default_value(0),
+         "handler threads per connection (0 = consumer thread)")
+        ("prefetch", bop::value<Bytes>()->default_value({0}),
+         "bytes to prefetch ahead of the current batch");
     // clang-format on
 
     bop::positional_options_description p;
@@ -76,14 +337,65 @@ int main(int argc, char* argv[]) {
     }
     std::cout << '\n';
 
+    std::unique_ptr<Handler> handler;
+    ReportingHandler* reporting = nullptr;
+    auto handler_name = vm["handler"].as<std::string>();
+    if (handler_name == "none") {
+        handler.reset(new NullHandler);
+    } else if (handler_name == "checksum") {
+        handler.reset(reporting = new ChecksumHandler);
+    } else if (handler_name == "latency") {
+        handler.reset(reporting = new LatencyHandler);
+    } else {
+        LOG_ERR_EXIT("unknown handler", EINVAL, std::system_category());
+    }
+    size_t handler_batch = vm["batch"].as<size_t>();
+    size_t handler_workers = vm["workers"].as<size_t>();
+    size_t prefetch = vm["prefetch"].as<Bytes>().value;
+
+    if (reporting) {
+        std::thread{[=]() {
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                reporting->report(std::cout);
+            }
+        }}.detach();
+    }
+
+    TRACE_START("bq_server");
+
+    size_t pool_size = vm["pool"].as<size_t>();
+    bool hugepages = vm.count("h");
+    bool odp = vm.count("odp");
+    /* One pool (and PD) per device, prefilled before we accept anything.
+     * QPs are created on the pool's PD so its rings can be used directly. */
+    std::map<ibv_context*, std::unique_ptr<RingPool>> pools;
+    int ndevices;
+    ibv_context** devices = rdma_get_devices(&ndevices);
+    LOG_ERR_EXIT(!devices, errno, std::system_category());
+    for (int i = 0; i < ndevices; i++) {
+        if (id->verbs && devices[i] != id->verbs) {
+            continue;
+        }
+        ibv_pd* pd;
+        LOG_ERR_EXIT(!(pd = ibv_alloc_pd(devices[i])), errno,
+                     std::system_category());
+        pools[devices[i]].reset(new RingPool{devices[i], pd, size.value,
+                                             hugepages, odp, pool_size});
+    }
+    rdma_free_devices(devices);
+
     LOG_ERR_EXIT(rdma_listen(id, connection_backlog), errno,
                  std::system_category());
 
+    std::map<uint64_t, std::weak_ptr<Session>> sessions;
     size_t nclients = 0;
+    std::chrono::nanoseconds total_setup{0};
     while (true) {
         rdma_cm_id* child_id;
         LOG_ERR_EXIT(rdma_get_request(id, &child_id), errno,
                      std::system_category());
+        auto setup_start = std::chrono::steady_clock::now();
 
         sockaddr_in* child_addr =
             reinterpret_cast<sockaddr_in*>(rdma_get_peer_addr(child_id));
@@ -93,36 +405,66 @@ int main(int argc, char* argv[]) {
                   << ntohs(listen_addr->sin_port) << " <- "
                   << psl::terminal::graphic_format::BOLD << child_addr->sin_addr
                   << ":" << ntohs(child_addr->sin_port)
-                  << psl::terminal::graphic_format::RESET << '\n';
+                  << psl::terminal::graphic_format::RESET;
         nclients++;
 
-        auto mem = std::make_shared<bounded_queue::Memory>(size.value);
-        if (vm.count("h")) {
-#ifdef MADV_HUGEPAGE
-            LOG_ERR_EXIT(madvise(mem->raw(), mem->raw_size(), MADV_HUGEPAGE),
-                         errno, std::system_category());
-#else
-            LOG_ERR_EXIT("no hugepage support!", EINVAL,
+        ClientConnectionData client_data;
+        LOG_ERR_EXIT(child_id->event->param.conn.private_data_len <
+                         sizeof(client_data),
+                     EINVAL, std::system_category());
+        client_data = *reinterpret_cast<const ClientConnectionData*>(
+                          child_id->event->param.conn.private_data);
+
+        auto& pool = pools[child_id->verbs];
+        if (!pool) {
+            /* device showed up after start, serve it without warm rings */
+            ibv_pd* pd;
+            LOG_ERR_EXIT(!(pd = ibv_alloc_pd(child_id->verbs)), errno,
                          std::system_category());
-#endif
+            pool.reset(new RingPool{child_id->verbs, pd, size.value,
+                                    hugepages, odp, 0});
         }
-        memset(mem->raw(), 0, mem->size());
-        ibv_mr* mr;
-        LOG_ERR_EXIT(
-            !(mr = ibv_reg_mr(child_id->pd, mem->raw(), mem->raw_size(),
-                              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
-                                  IBV_ACCESS_REMOTE_READ |
-                                  IBV_ACCESS_REMOTE_ATOMIC)),
-            errno, std::system_category());
-
-        ibv_device_attr dev_attr;
-        LOG_ERR_EXIT(ibv_query_device(child_id->verbs, &dev_attr), errno,
-                     std::system_category());
+        const ibv_device_attr& dev_attr = pool->dev_attr();
 
+        std::shared_ptr<Session> session;
+        bool pooled = true;
+        ibv_mr* mr;
         ibv_cq* cq;
-        LOG_ERR_EXIT(
-            !(cq = ibv_create_cq(child_id->verbs, 16, nullptr, nullptr, 0)),
-            errno, std::system_category());
+        if (client_data.rail == 0) {
+            for (auto s = sessions.begin(); s != sessions.end();) {
+                s = s->second.expired() ? sessions.erase(s) : std::next(s);
+            }
+            auto ring = pool->get();
+            pooled = ring.second;
+            session = std::make_shared<Session>(pool.get(), ring.first);
+            sessions[client_data.session] = session;
+            mr = session->ring.mr;
+            cq = session->ring.cq;
+        } else {
+            auto s = sessions.find(client_data.session);
+            if (s == sessions.end() || !(session = s->second.lock())) {
+                std::cout << " unknown session, rejected\n";
+                rdma_reject(child_id, nullptr, 0);
+                rdma_destroy_id(child_id);
+                continue;
+            }
+            std::cout << " rail " << client_data.rail;
+            /* an extra rail might be on another device */
+            if (pool->pd() == session->pool->pd()) {
+                mr = session->ring.mr;
+            } else {
+                LOG_ERR_EXIT(
+                    !(mr = ibv_reg_mr(pool->pd(), session->ring.mem->raw(),
+                                      session->ring.mem->raw_size(),
+                                      IBV_ACCESS_LOCAL_WRITE |
+                                          IBV_ACCESS_REMOTE_WRITE)),
+                    errno, std::system_category());
+            }
+            LOG_ERR_EXIT(
+                !(cq = ibv_create_cq(child_id->verbs, 16, nullptr, nullptr, 0)),
+                errno, std::system_category());
+        }
+        auto mem = session->ring.mem;
 
         ibv_qp_init_attr qp_init_attr = {};
         qp_init_attr.qp_type = IBV_QPT_RC;
@@ -134,16 +476,9 @@ int main(int argc, char* argv[]) {
         qp_init_attr.cap.max_send_wr = 16;
         qp_init_attr.cap.max_recv_sge = 1;
         qp_init_attr.cap.max_send_sge = 1;
-        LOG_ERR_EXIT(rdma_create_qp(child_id, child_id->pd, &qp_init_attr),
+        LOG_ERR_EXIT(rdma_create_qp(child_id, pool->pd(), &qp_init_attr),
                      errno, std::system_category());
 
-        ClientConnectionData client_data;
-        LOG_ERR_EXIT(child_id->event->param.conn.private_data_len <
-                         sizeof(client_data),
-                     EINVAL, std::system_category());
-        client_data = *reinterpret_cast<const ClientConnectionData*>(
-                          child_id->event->param.conn.private_data);
-
         ServerConnectionData conn_data;
         conn_data.address = reinterpret_cast<uint64_t>(mem->raw());
         conn_data.size = mem->size();
@@ -156,40 +491,83 @@ int main(int argc, char* argv[]) {
         LOG_ERR_EXIT(rdma_accept(child_id, &conn_param), errno,
                      std::system_category());
 
-        std::thread{[=]() {
-            Consumer c{mem};
-            uint64_t old_back = c.back();
-            ibv_send_wr wr = {};
-            wr.next = NULL;
-            ibv_sge sge;
-            sge.addr = reinterpret_cast<uint64_t>(&old_back);
-            sge.length = sizeof(old_back);
-            wr.num_sge = 1;
-            wr.sg_list = &sge;
-            wr.wr.rdma.remote_addr = client_data.address;
-            wr.wr.rdma.rkey = client_data.rkey;
-            wr.opcode = IBV_WR_RDMA_WRITE;
-            wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
-            wr.next = nullptr;
+        auto setup = std::chrono::steady_clock::now() - setup_start;
+        total_setup += setup;
+        using std::chrono::microseconds;
+        using std::chrono::duration_cast;
+        std::cout << " setup = "
+                  << duration_cast<microseconds>(setup).count() << "us"
+                  << (pooled ? "" : " (cold)") << " avg = "
+                  << duration_cast<microseconds>(total_setup).count() /
+                         nclients
+                  << "us\n";
 
-            size_t i = 0;
-            constexpr size_t batch = 8;
-            ibv_wc wc[batch];
-            while (true) {
-                c.consume();
-                if (c.back() - old_back > mem->size() / 2) {
-                    old_back = c.back();
-                    ibv_send_wr* bad_wr;
-                    LOG_ERR_EXIT(ibv_post_send(child_id->qp, &wr, &bad_wr),
-                                 errno, std::system_category());
+        if (client_data.rail != 0) {
+            /* session (and with it the ring) is released when this ends */
+            std::thread{[=]() {
+                wait_disconnect(child_id);
+                rdma_destroy_qp(child_id);
+                rdma_destroy_id(child_id);
+                if (mr != session->ring.mr) {
+                    ibv_dereg_mr(mr);
                 }
-                if (i++ % batch == 0) {
-                    int num_wc;
-                    LOG_ERR_EXIT((num_wc = ibv_poll_cq(cq, batch, wc)) < 0,
-                                 errno, std::system_category());
-                    i -= num_wc;
+                ibv_destroy_cq(cq);
+            }}.detach();
+            continue;
+        }
+
+        Handler* h = handler.get();
+        std::thread{[=]() mutable {
+            std::atomic<bool> connected{true};
+            std::thread consumer{[&]() {
+                Pipeline pipeline{mem, *h, handler_batch, handler_workers,
+                                  prefetch};
+                uint64_t old_back = pipeline.back();
+                ibv_send_wr wr = {};
+                wr.next = NULL;
+                ibv_sge sge;
+                sge.addr = reinterpret_cast<uint64_t>(&old_back);
+                sge.length = sizeof(old_back);
+                wr.num_sge = 1;
+                wr.sg_list = &sge;
+                wr.wr.rdma.remote_addr = client_data.address;
+                wr.wr.rdma.rkey = client_data.rkey;
+                wr.opcode = IBV_WR_RDMA_WRITE;
+                wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+                wr.next = nullptr;
+
+                size_t i = 0;
+                constexpr size_t batch = 8;
+                ibv_wc wc[batch];
+                while (connected.load(std::memory_order_relaxed)) {
+                    bounded_queue::Index released = pipeline.poll();
+                    if (released - old_back > mem->size() / 2) {
+                        old_back = released;
+                        ibv_send_wr* bad_wr;
+                        TRACE_SCOPE("ibv_post_send");
+                        LOG_ERR_EXIT(ibv_post_send(child_id->qp, &wr, &bad_wr),
+                                     errno, std::system_category());
+                    }
+                    if (i++ % batch == 0) {
+                        uint64_t t = TRACE_NOW();
+                        int num_wc;
+                        LOG_ERR_EXIT((num_wc = ibv_poll_cq(cq, batch, wc)) < 0,
+                                     errno, std::system_category());
+                        if (num_wc) {
+                            TRACE_COMPLETE("ibv_poll_cq", t);
+                        }
+                        i -= num_wc;
+                    }
                 }
-            }
+            }};
+
+            wait_disconnect(child_id);
+            connected = false;
+            consumer.join();
+            rdma_destroy_qp(child_id);
+            rdma_destroy_id(child_id);
+            /* last user of the ring unless other rails are still up */
+            session.reset();
         }}.detach();
     }
 
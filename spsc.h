@@ -0,0 +1,74 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+#include <bounded_queue.h>
+
+namespace bounded_queue {
+
+/* Fixed capacity single producer / single consumer ring of small values
+ * (e.g. pointers) used to hand work between local threads. Shares the index
+ * layout of LocalProducer/LocalConsumer: the published indices sit on their
+ * own cache lines and each side keeps a cached copy of the other's index,
+ * reloading it only when the ring looks full or empty. */
+template <class T> class Spsc {
+  private:
+    std::vector<T> slots_;
+    size_t mask_;
+    /* front = next slot to push, back = next slot to pop */
+    LocalIndices idx_;
+
+    /* producer */
+    Index front_;
+    Index cached_back_;
+    char pad0_[cache_line];
+    /* consumer */
+    Index back_;
+    Index cached_front_;
+    char pad1_[cache_line];
+
+    static size_t round_up(size_t n) {
+        size_t r = 1;
+        while (r < n) {
+            r <<= 1;
+        }
+        return r;
+    }
+
+  public:
+    explicit Spsc(size_t capacity)
+        : slots_(round_up(capacity)), mask_{slots_.size() - 1}, front_{0},
+          cached_back_{0}, back_{0}, cached_front_{0} {}
+
+    bool push(const T& value) {
+        if (front_ - cached_back_ == slots_.size()) {
+            cached_back_ = idx_.back.load(std::memory_order_acquire);
+            if (front_ - cached_back_ == slots_.size()) {
+                return false;
+            }
+        }
+        slots_[front_ & mask_] = value;
+        idx_.front.store(++front_, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        if (back_ == cached_front_) {
+            cached_front_ = idx_.front.load(std::memory_order_acquire);
+            if (back_ == cached_front_) {
+                return false;
+            }
+        }
+        value = slots_[back_ & mask_];
+        idx_.back.store(++back_, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return slots_.size(); }
+};
+}
+
+#endif /* SPSC_H */
@@ -0,0 +1,119 @@
+#include <trace.h>
+
+#ifdef BQ_TRACE
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace bounded_queue::trace;
+
+thread_local Local bounded_queue::trace::local;
+
+namespace {
+
+class Writer {
+  private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+    uint32_t next_tid_ = 0;
+    std::ofstream out_;
+    pid_t pid_;
+    uint64_t tsc0_;
+    double ticks_per_us_;
+    bool first_ = true;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+
+    void calibrate() {
+        using namespace std::chrono;
+        auto t0 = steady_clock::now();
+        tsc0_ = now();
+        std::this_thread::sleep_for(milliseconds(20));
+        uint64_t tsc1 = now();
+        auto us = duration_cast<duration<double, std::micro>>(
+            steady_clock::now() - t0);
+        ticks_per_us_ = (tsc1 - tsc0_) / us.count();
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (auto it = buffers_.begin(); it != buffers_.end();) {
+            Buffer& b = **it;
+            /* read before draining, a retired buffer gets no more events */
+            bool retired = b.retired.load();
+            Event e;
+            while (b.events.pop(e)) {
+                out_ << (first_ ? "" : ",\n") << "{\"name\":\"" << e.name
+                     << "\",\"ph\":\"X\",\"pid\":" << pid_
+                     << ",\"tid\":" << b.tid
+                     << ",\"ts\":" << (e.start - tsc0_) / ticks_per_us_
+                     << ",\"dur\":" << (e.end - e.start) / ticks_per_us_
+                     << "}";
+                first_ = false;
+            }
+            uint64_t dropped = b.dropped.exchange(0);
+            if (dropped) {
+                out_ << (first_ ? "" : ",\n") << "{\"name\":\"dropped "
+                     << dropped << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":"
+                     << pid_ << ",\"tid\":" << b.tid << ",\"ts\":"
+                     << (now() - tsc0_) / ticks_per_us_ << "}";
+                first_ = false;
+            }
+            it = retired ? buffers_.erase(it) : std::next(it);
+        }
+        out_.flush();
+    }
+
+  public:
+    void start(const char* prefix) {
+        pid_ = getpid();
+        out_.open(std::string{prefix} + "." + std::to_string(pid_) + ".json");
+        out_ << std::fixed << std::setprecision(3) << "[\n";
+        calibrate();
+        thread_ = std::thread{[this]() {
+            while (!stop_.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                drain();
+            }
+        }};
+    }
+
+    Buffer* attach() {
+        std::unique_ptr<Buffer> b{new Buffer};
+        std::lock_guard<std::mutex> lock{mutex_};
+        b->tid = next_tid_++;
+        buffers_.push_back(std::move(b));
+        return buffers_.back().get();
+    }
+
+    ~Writer() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        stop_ = true;
+        thread_.join();
+        drain();
+        out_ << "\n]\n";
+        /* detached threads may still record, never free their buffers */
+        for (auto& b : buffers_) {
+            b.release();
+        }
+    }
+};
+
+Writer writer;
+}
+
+Buffer* bounded_queue::trace::attach() { return writer.attach(); }
+
+void bounded_queue::trace::start(const char* prefix) { writer.start(prefix); }
+
+#endif /* BQ_TRACE */
@@ -0,0 +1,107 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <spsc.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/* Event tracing of the hot loops, compiled in with -DBQ_TRACE (cmake
+ * -DBQ_TRACE=ON). Every thread records complete events (name, start, end in
+ * TSC ticks) into its own SPSC buffer, a background thread drains them into
+ * <prefix>.<pid>.json in Chrome trace format (chrome://tracing, Perfetto).
+ * Events are dropped, not waited for, when a buffer is full. Names must be
+ * string literals. Without BQ_TRACE all macros compile to nothing. */
+
+namespace bounded_queue {
+namespace trace {
+
+struct Event {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct Buffer {
+    Spsc<Event> events{1 << 16};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false};
+    uint32_t tid;
+};
+
+/* registers the calling thread with the writer */
+Buffer* attach();
+
+/* per thread buffer, retired when the thread exits */
+struct Local {
+    Buffer* buffer = nullptr;
+    ~Local() {
+        if (buffer) {
+            buffer->retired = true;
+        }
+    }
+};
+
+extern thread_local Local local;
+
+inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+               steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline void complete(const char* name, uint64_t start) {
+    uint64_t end = now();
+    Buffer* b = local.buffer;
+    if (!b) {
+        b = local.buffer = attach();
+    }
+    if (!b->events.push({name, start, end})) {
+        b->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+class Scope {
+  private:
+    const char* name_;
+    uint64_t start_;
+
+  public:
+    explicit Scope(const char* name) : name_{name}, start_{now()} {}
+    ~Scope() { complete(name_, start_); }
+};
+
+/* starts the writer, output goes to <prefix>.<pid>.json */
+void start(const char* prefix);
+}
+}
+
+#ifdef BQ_TRACE
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+#define TRACE_START(prefix) ::bounded_queue::trace::start(prefix)
+/* records the enclosing scope */
+#define TRACE_SCOPE(name)                                                      \
+    ::bounded_queue::trace::Scope TRACE_CAT(trace_scope_, __LINE__) { name }
+/* records [start, now), start taken with TRACE_NOW() */
+#define TRACE_NOW() ::bounded_queue::trace::now()
+#define TRACE_COMPLETE(name, start)                                            \
+    ::bounded_queue::trace::complete(name, start)
+#else
+#define TRACE_START(prefix) ((void)0)
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_NOW() uint64_t{0}
+#define TRACE_COMPLETE(name, start) ((void)(start))
+#endif
+
+#endif /* TRACE_H */